@@ -0,0 +1,72 @@
+#include <graph2grid/system.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+  // Builds a wide tree whose subsystems differ in size by more than an order
+  // of magnitude, so a fixed partition of the tasks can end up unbalanced.
+  void fill(zg2g::System &system, std::size_t depth, std::uint32_t &state) {
+    auto next = [&state] { return state = state * 1664525u + 1013904223u; };
+    std::size_t count = next() % 4 == 0 ? 200 + next() % 200 : 10 + next() % 20;
+    for (std::size_t i = 0; i < count; ++i) system.addComponent("c" + std::to_string(i));
+    for (std::size_t i = 0; i < count * 2; ++i) {
+      std::size_t from = next() % count;
+      std::size_t to = next() % count;
+      if (from != to) system.connect(from, to);
+    }
+    if (depth == 0) return;
+    for (std::size_t i = 0; i < 12; ++i)
+      fill(system.addSubsystem("s" + std::to_string(i)), depth - 1, state);
+  }
+
+  // Median wall time of converting fresh copies of the plant.
+  double measure(const zg2g::System &plant, const zg2g::ExecutionPolicy &policy,
+                 int repetitions) {
+    std::vector<double> seconds;
+    // the first run only warms up the allocator and the caches
+    zg2g::System(plant).toGrid(policy);
+    for (int i = 0; i < repetitions; ++i) {
+      zg2g::System copy(plant);
+      auto start = std::chrono::steady_clock::now();
+      copy.toGrid(policy);
+      seconds.push_back(
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(seconds.begin(), seconds.end());
+    return seconds[seconds.size() / 2];
+  }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int repetitions = argc > 1 ? std::atoi(argv[1]) : 21;
+
+  std::uint32_t state = 7;
+  zg2g::System plant("plant");
+  fill(plant, 2, state);
+
+  std::cout << "hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+  std::cout << "threads  on-demand [s]  deterministic [s]  ratio" << std::endl;
+  for (std::size_t threads : {1, 2, 4, 8, 16}) {
+    zg2g::ExecutionPolicy policy;
+    policy.threads = threads;
+    double onDemand = measure(plant, policy, repetitions);
+    policy.deterministic = true;
+    double deterministic = measure(plant, policy, repetitions);
+
+    std::cout << std::setw(7) << threads << std::fixed << std::setprecision(4) << std::setw(15)
+              << onDemand << std::setw(19) << deterministic << std::setprecision(2)
+              << std::setw(7) << deterministic / onDemand << std::endl;
+  }
+
+  return 0;
+}
@@ -1,17 +1,90 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 #include <memory>
 #include <spimpl.h>
 
 namespace zg2g {
 
+/// Grid of component names, an empty name marks a free cell.
+///
+/// The grid of a system with subsystems does not copy their cells, it refers
+/// to the converted grids as blocks and resolves at() through them.
+struct Grid {
+    struct Block {
+        std::shared_ptr<const Grid> grid;
+        std::size_t left = 0;
+        std::size_t top = 0;
+        /// Put in front of every name in the block, e.g. "feed/".
+        std::string prefix;
+    };
+
+    std::size_t width = 0;
+    std::size_t height = 0;
+    /// Row-major names, only used by grids without blocks.
+    std::vector<std::string> cells;
+    std::vector<Block> blocks;
+
+    std::string at(std::size_t x, std::size_t y) const;
+
+    bool operator==(const Grid &other) const;
+    bool operator!=(const Grid &other) const;
+};
+
+/// Controls how the conversion is spread over threads.
+///
+/// Component orderings are refined from randomized restarts. Every system
+/// draws from its own random stream keyed by the seed, its name and its
+/// components and edges, so the grids only depend on the seed, never on the
+/// number of threads or the scheduling. Deterministic mode additionally hands the tasks
+/// to the threads in a fixed partition instead of on demand.
+struct ExecutionPolicy {
+    /// Zero uses the hardware concurrency.
+    std::size_t threads = 0;
+    bool deterministic = false;
+    std::uint64_t seed = 0;
+    /// Called with the name of every system before it is converted, possibly
+    /// from several threads at once. An exception thrown from it stops the
+    /// conversion and is rethrown by System::toGrid().
+    std::function<void(const std::string &name)> onConvert;
+};
+
+/// Graph of components which may contain nested subsystems.
+///
+/// Every subsystem is converted into its own grid block and the parent lays
+/// the blocks out below its own components. Converted grids are cached, so
+/// after a change only the modified systems (and their ancestors, which
+/// re-lay out the blocks) are recomputed.
 class System {
     struct PImpl;
     spimpl::impl_ptr<PImpl> impl;
 
 public:
     System();
+    explicit System(std::string name);
+
+    const std::string &name() const;
+
+    std::size_t addComponent(std::string name);
+    void connect(std::size_t from, std::size_t to);
+
+    /// The returned reference stays valid as further subsystems are added.
+    /// Throws std::invalid_argument for an empty name or one already used by
+    /// another subsystem, as the name prefixes the cells of its block.
+    System &addSubsystem(std::string name);
+    System &subsystem(std::size_t index);
+    const System &subsystem(std::size_t index) const;
+    std::size_t subsystemCount() const;
+
+    /// True when this system or any of its subsystems changed since the
+    /// last conversion.
+    bool isDirty() const;
+
+    /// Converts the system, independent subsystems are converted in parallel.
+    std::shared_ptr<const Grid> toGrid(const ExecutionPolicy &policy = {});
 };
 
 }
@@ -1,14 +1,524 @@
 #include <graph2grid/system.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
 using namespace zg2g;
 
+namespace {
+
+constexpr std::size_t unassigned = static_cast<std::size_t>(-1);
+constexpr std::size_t orderingAttempts = 8;
+
+using Rng = std::mt19937_64;
+
+// Reorders every column by the barycenter of its predecessors in the column
+// before, components without such predecessors keep their current row.
+void orderByBarycenter(std::vector<std::vector<std::size_t>> &columns,
+                       const std::vector<std::vector<std::size_t>> &predecessors,
+                       const std::vector<std::size_t> &layer)
+{
+    std::vector<double> row(layer.size());
+    std::vector<double> barycenter(layer.size());
+    for (auto &column : columns) {
+        for (std::size_t i = 0; i < column.size(); ++i) {
+            double sum = 0.0;
+            std::size_t placed = 0;
+            for (std::size_t from : predecessors[column[i]]) {
+                if (layer[from] + 1 == layer[column[i]]) {
+                    sum += row[from];
+                    ++placed;
+                }
+            }
+            barycenter[column[i]] = placed ? sum / placed : static_cast<double>(i);
+        }
+        std::stable_sort(column.begin(), column.end(), [&](std::size_t a, std::size_t b) {
+            return barycenter[a] < barycenter[b];
+        });
+        for (std::size_t i = 0; i < column.size(); ++i)
+            row[column[i]] = static_cast<double>(i);
+    }
+}
+
+// Counts the crossings of edges between neighbouring columns. With the edges
+// sorted by their left end, two edges cross when their right ends are
+// inverted, which a Fenwick tree over the rows counts in O(E log E).
+std::size_t countCrossings(const std::vector<std::vector<std::size_t>> &columns,
+                           const std::vector<std::vector<std::size_t>> &predecessors,
+                           const std::vector<std::size_t> &layer)
+{
+    std::vector<std::size_t> row(layer.size(), 0);
+    for (const auto &column : columns) {
+        for (std::size_t i = 0; i < column.size(); ++i)
+            row[column[i]] = i;
+    }
+
+    std::size_t crossings = 0;
+    std::vector<std::pair<std::size_t, std::size_t>> spans;
+    std::vector<std::size_t> tree;
+    for (std::size_t x = 1; x < columns.size(); ++x) {
+        spans.clear();
+        for (std::size_t to : columns[x]) {
+            for (std::size_t from : predecessors[to]) {
+                if (layer[from] + 1 == x)
+                    spans.emplace_back(row[from], row[to]);
+            }
+        }
+        std::sort(spans.begin(), spans.end());
+
+        // tree counts the right ends seen so far, edges sharing a left end
+        // are sorted by their right end and never count as crossing
+        tree.assign(columns[x].size() + 1, 0);
+        for (std::size_t seen = 0; seen < spans.size(); ++seen) {
+            std::size_t notAbove = 0;
+            for (std::size_t i = spans[seen].second + 1; i > 0; i -= i & (~i + 1))
+                notAbove += tree[i];
+            crossings += seen - notAbove;
+            for (std::size_t i = spans[seen].second + 1; i < tree.size(); i += i & (~i + 1))
+                ++tree[i];
+        }
+    }
+    return crossings;
+}
+
+// Derives independent random streams from a seed (splitmix64 finalizer).
+std::uint64_t mixSeed(std::uint64_t seed, std::uint64_t salt)
+{
+    std::uint64_t z = seed + 0x9e3779b97f4a7c15ull * (salt + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// FNV-1a, unlike std::hash the value is the same on every platform.
+constexpr std::uint64_t hashBasis = 0xcbf29ce484222325ull;
+
+std::uint64_t hashString(std::uint64_t hash, const std::string &text)
+{
+    for (unsigned char c : text)
+        hash = (hash ^ c) * 0x100000001b3ull;
+    // the terminator keeps {"ab", "c"} and {"a", "bc"} apart
+    return (hash ^ 0xffu) * 0x100000001b3ull;
+}
+
+std::uint64_t hashIndex(std::uint64_t hash, std::size_t index)
+{
+    for (int shift = 0; shift < 64; shift += 8)
+        hash = (hash ^ ((static_cast<std::uint64_t>(index) >> shift) & 0xffu)) * 0x100000001b3ull;
+    return hash;
+}
+
+// Assigns every component to a column by breadth-first distance from the
+// sources, then orders the columns to reduce edge crossings.
+Grid layoutComponents(const std::vector<std::string> &components,
+                      const std::vector<std::pair<std::size_t, std::size_t>> &edges, Rng &rng)
+{
+    const std::size_t count = components.size();
+    std::vector<std::vector<std::size_t>> successors(count);
+    std::vector<std::vector<std::size_t>> predecessors(count);
+    for (const auto &[from, to] : edges) {
+        successors[from].push_back(to);
+        predecessors[to].push_back(from);
+    }
+
+    std::vector<std::size_t> layer(count, unassigned);
+    std::deque<std::size_t> queue;
+    auto visitFrom = [&](std::size_t start) {
+        layer[start] = 0;
+        queue.push_back(start);
+        while (!queue.empty()) {
+            std::size_t node = queue.front();
+            queue.pop_front();
+            for (std::size_t next : successors[node]) {
+                if (layer[next] == unassigned) {
+                    layer[next] = layer[node] + 1;
+                    queue.push_back(next);
+                }
+            }
+        }
+    };
+    for (std::size_t node = 0; node < count; ++node) {
+        if (predecessors[node].empty() && layer[node] == unassigned)
+            visitFrom(node);
+    }
+    // components only reachable through cycles start their own trees
+    for (std::size_t node = 0; node < count; ++node) {
+        if (layer[node] == unassigned)
+            visitFrom(node);
+    }
+
+    std::vector<std::vector<std::size_t>> columns;
+    for (std::size_t node = 0; node < count; ++node) {
+        if (layer[node] >= columns.size())
+            columns.resize(layer[node] + 1);
+        columns[layer[node]].push_back(node);
+    }
+
+    // the first attempt keeps the insertion order, the others start from a
+    // shuffled one, the attempt with the fewest crossings wins and ties go to
+    // the earliest attempt
+    std::vector<std::vector<std::size_t>> best;
+    std::size_t bestCrossings = unassigned;
+    for (std::size_t attempt = 0; attempt < orderingAttempts; ++attempt) {
+        auto candidate = columns;
+        if (attempt > 0) {
+            for (auto &column : candidate)
+                std::shuffle(column.begin(), column.end(), rng);
+        }
+        orderByBarycenter(candidate, predecessors, layer);
+
+        std::size_t crossings = countCrossings(candidate, predecessors, layer);
+        if (crossings < bestCrossings) {
+            best = std::move(candidate);
+            bestCrossings = crossings;
+        }
+        if (bestCrossings == 0)
+            break;
+    }
+    if (!best.empty())
+        columns = std::move(best);
+
+    Grid grid;
+    grid.width = columns.size();
+    for (const auto &column : columns)
+        grid.height = std::max(grid.height, column.size());
+    grid.cells.resize(grid.width * grid.height);
+    for (std::size_t x = 0; x < columns.size(); ++x) {
+        for (std::size_t y = 0; y < columns[x].size(); ++y)
+            grid.cells[y * grid.width + x] = components[columns[x][y]];
+    }
+    return grid;
+}
+
+// Conversion tasks in post-order, every task comes after its subtasks.
+struct TaskTree
+{
+    std::vector<std::size_t> parents;
+    // number of unfinished subtasks
+    std::vector<std::size_t> pending;
+};
+
+// Runs every task of the tree once all of its subtasks are done. The workers
+// are started once, and a task becomes ready as soon as its own subtasks
+// finish, so sibling subtrees never wait for each other. Deterministic runs
+// always hand task i to worker i % workers, otherwise the workers share one
+// queue and take the next ready task as soon as they are free. The first
+// exception thrown by a task stops the remaining ones and is rethrown once
+// all workers are joined.
+void runTree(TaskTree tree, const ExecutionPolicy &policy,
+             const std::function<void(std::size_t)> &task)
+{
+    const std::size_t count = tree.parents.size();
+    std::size_t threads = policy.threads ? policy.threads
+                                         : std::max(1u, std::thread::hardware_concurrency());
+    std::size_t workers = std::min(count, threads);
+    if (workers <= 1) {
+        for (std::size_t i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    std::size_t queueCount = policy.deterministic ? workers : 1;
+    std::vector<std::deque<std::size_t>> queues(queueCount);
+    for (std::size_t i = 0; i < count; ++i) {
+        if (tree.pending[i] == 0)
+            queues[i % queueCount].push_back(i);
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::size_t remaining = count;
+    std::exception_ptr error;
+    auto work = [&](std::size_t worker) {
+        auto &queue = queues[worker % queueCount];
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return error || remaining == 0 || !queue.empty(); });
+            if (error || remaining == 0)
+                return;
+            std::size_t i = queue.front();
+            queue.pop_front();
+
+            lock.unlock();
+            try {
+                task(i);
+            } catch (...) {
+                lock.lock();
+                if (!error)
+                    error = std::current_exception();
+                wake.notify_all();
+                return;
+            }
+            lock.lock();
+
+            --remaining;
+            std::size_t parent = tree.parents[i];
+            if (parent != unassigned && --tree.pending[parent] == 0)
+                queues[parent % queueCount].push_back(parent);
+            wake.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    try {
+        for (std::size_t worker = 1; worker < workers; ++worker)
+            pool.emplace_back(work, worker);
+    } catch (...) {
+        // tasks of workers which could not be started would never run
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+    }
+    work(0);
+    for (auto &thread : pool)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+}
+
+std::string Grid::at(std::size_t x, std::size_t y) const
+{
+    if (x >= width || y >= height)
+        throw std::out_of_range("zg2g::Grid::at: cell outside of the grid");
+
+    if (blocks.empty())
+        return cells[y * width + x];
+    for (const auto &block : blocks) {
+        if (x >= block.left && x - block.left < block.grid->width && y >= block.top
+            && y - block.top < block.grid->height) {
+            std::string name = block.grid->at(x - block.left, y - block.top);
+            return name.empty() ? name : block.prefix + name;
+        }
+    }
+    return {};
+}
+
+// Compares the names, so grids with the same content but built from
+// different blocks are equal.
+bool Grid::operator==(const Grid &other) const
+{
+    if (width != other.width || height != other.height)
+        return false;
+    for (std::size_t y = 0; y < height; ++y) {
+        for (std::size_t x = 0; x < width; ++x) {
+            if (at(x, y) != other.at(x, y))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool Grid::operator!=(const Grid &other) const
+{
+    return !(*this == other);
+}
+
 struct System::PImpl
 {
-    PImpl()
+    PImpl(std::string name)
+        : name(std::move(name))
+    {
+    }
+
+    std::string name;
+    std::vector<std::string> components;
+    std::vector<std::pair<std::size_t, std::size_t>> edges;
+    std::deque<System> subsystems;
+
+    std::shared_ptr<const Grid> componentGrid;
+    // policy seed the component grid was produced with
+    std::optional<std::uint64_t> componentSeed;
+    std::shared_ptr<const Grid> grid;
+    // subsystem grids the blocks of the grid were laid out from
+    std::vector<std::shared_ptr<const Grid>> blocks;
+    bool dirty = true;
+
+    // Whether a subsystem was converted on its own since the last layout.
+    bool blocksChanged() const
     {
+        if (blocks.size() != subsystems.size())
+            return true;
+        for (std::size_t i = 0; i < blocks.size(); ++i) {
+            if (blocks[i] != subsystems[i].impl->grid)
+                return true;
+        }
+        return false;
+    }
+
+    // Key of the random stream, made from the name and the components and
+    // edges of the system, so it does not depend on where in the hierarchy
+    // the conversion started. Systems sharing a key are identical and get
+    // the same grid anyway.
+    std::uint64_t streamKey() const
+    {
+        std::uint64_t hash = hashString(hashBasis, name);
+        for (const auto &component : components)
+            hash = hashString(hash, component);
+        for (const auto &[from, to] : edges)
+            hash = hashIndex(hashIndex(hash, from), to);
+        return hash;
+    }
+
+    // Adds the systems needing conversion to the tree and returns the task
+    // of this system, or unassigned if it is up to date. Component grids made
+    // with another policy seed are not reused.
+    std::size_t collect(std::uint64_t policySeed, TaskTree &tree, std::vector<PImpl *> &systems)
+    {
+        std::vector<std::size_t> subtasks;
+        for (auto &subsystem : subsystems) {
+            std::size_t subtask = subsystem.impl->collect(policySeed, tree, systems);
+            if (subtask != unassigned)
+                subtasks.push_back(subtask);
+        }
+        if (componentSeed != policySeed) {
+            componentGrid.reset();
+            dirty = true;
+        }
+        if (!dirty && subtasks.empty() && !blocksChanged())
+            return unassigned;
+
+        std::size_t task = systems.size();
+        systems.push_back(this);
+        tree.parents.push_back(unassigned);
+        tree.pending.push_back(subtasks.size());
+        for (std::size_t subtask : subtasks)
+            tree.parents[subtask] = task;
+        return task;
+    }
+
+    // Lays out the own components on top and the subsystem blocks in a row
+    // below, expects the subsystems to be converted already. The blocks refer
+    // to the cached grids, so this is linear in the number of subsystems.
+    void convert(std::uint64_t policySeed)
+    {
+        if (!componentGrid) {
+            Rng rng(mixSeed(policySeed, streamKey()));
+            componentGrid = std::make_shared<const Grid>(layoutComponents(components, edges, rng));
+            componentSeed = policySeed;
+        }
+
+        std::size_t blocksWidth = 0;
+        std::size_t blocksHeight = 0;
+        for (const auto &subsystem : subsystems) {
+            const Grid &block = *subsystem.impl->grid;
+            blocksWidth += (blocksWidth ? 1 : 0) + block.width;
+            blocksHeight = std::max(blocksHeight, block.height);
+        }
+        std::size_t blocksTop = componentGrid->height;
+        if (blocksTop && blocksHeight)
+            ++blocksTop;
+
+        auto result = std::make_shared<Grid>();
+        result->width = std::max(componentGrid->width, blocksWidth);
+        result->height = blocksHeight ? blocksTop + blocksHeight : componentGrid->height;
+        result->blocks.push_back({componentGrid, 0, 0, {}});
+
+        std::size_t left = 0;
+        blocks.clear();
+        for (const auto &subsystem : subsystems) {
+            const auto &block = subsystem.impl->grid;
+            result->blocks.push_back({block, left, blocksTop, subsystem.impl->name + "/"});
+            left += block->width + 1;
+            blocks.push_back(block);
+        }
+
+        grid = std::move(result);
+        dirty = false;
     }
 };
 
 System::System()
+    : System(std::string())
 {
 }
+
+System::System(std::string name)
+    : impl(spimpl::make_impl<PImpl>(std::move(name)))
+{
+}
+
+const std::string &System::name() const
+{
+    return impl->name;
+}
+
+std::size_t System::addComponent(std::string name)
+{
+    impl->components.push_back(std::move(name));
+    impl->componentGrid.reset();
+    impl->dirty = true;
+    return impl->components.size() - 1;
+}
+
+void System::connect(std::size_t from, std::size_t to)
+{
+    if (from >= impl->components.size() || to >= impl->components.size())
+        throw std::out_of_range("zg2g::System::connect: unknown component");
+
+    impl->edges.emplace_back(from, to);
+    impl->componentGrid.reset();
+    impl->dirty = true;
+}
+
+System &System::addSubsystem(std::string name)
+{
+    // the name prefixes the cells of the block, it has to tell the blocks apart
+    if (name.empty())
+        throw std::invalid_argument("zg2g::System::addSubsystem: empty name");
+    for (const auto &subsystem : impl->subsystems) {
+        if (subsystem.name() == name)
+            throw std::invalid_argument("zg2g::System::addSubsystem: duplicate name " + name);
+    }
+
+    impl->dirty = true;
+    return impl->subsystems.emplace_back(std::move(name));
+}
+
+System &System::subsystem(std::size_t index)
+{
+    return impl->subsystems.at(index);
+}
+
+const System &System::subsystem(std::size_t index) const
+{
+    return impl->subsystems.at(index);
+}
+
+std::size_t System::subsystemCount() const
+{
+    return impl->subsystems.size();
+}
+
+bool System::isDirty() const
+{
+    if (impl->dirty || impl->blocksChanged())
+        return true;
+    return std::any_of(impl->subsystems.begin(), impl->subsystems.end(),
+                       [](const System &subsystem) { return subsystem.isDirty(); });
+}
+
+std::shared_ptr<const Grid> System::toGrid(const ExecutionPolicy &policy)
+{
+    TaskTree tree;
+    std::vector<PImpl *> systems;
+    impl->collect(policy.seed, tree, systems);
+
+    runTree(std::move(tree), policy, [&](std::size_t task) {
+        if (policy.onConvert)
+            policy.onConvert(systems[task]->name);
+        systems[task]->convert(policy.seed);
+    });
+
+    return impl->grid;
+}
@@ -2,10 +2,158 @@
 #include <graph2grid/system.h>
 #include <graph2grid/version.h>
 
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 TEST_CASE("System") {
   using namespace zg2g;
+
+  System plant("plant");
+  auto boiler = plant.addComponent("boiler");
+  auto turbine = plant.addComponent("turbine");
+  plant.connect(boiler, turbine);
+
+  auto &feed = plant.addSubsystem("feed");
+  feed.connect(feed.addComponent("tank"), feed.addComponent("pump"));
+  auto &cooling = plant.addSubsystem("cooling");
+  cooling.addComponent("tower");
+  CHECK_THROWS_AS(plant.addSubsystem("feed"), std::invalid_argument);
+  CHECK_THROWS_AS(plant.addSubsystem(""), std::invalid_argument);
+
+  auto grid = plant.toGrid();
+  CHECK(!plant.isDirty());
+  CHECK(grid->width == 4);
+  CHECK(grid->height == 3);
+  CHECK(grid->at(0, 0) == "boiler");
+  CHECK(grid->at(1, 0) == "turbine");
+  CHECK(grid->at(0, 2) == "feed/tank");
+  CHECK(grid->at(1, 2) == "feed/pump");
+  CHECK(grid->at(3, 2) == "cooling/tower");
+  CHECK_THROWS_AS(grid->at(4, 0), std::out_of_range);
+  CHECK_THROWS_AS(grid->at(0, 3), std::out_of_range);
+  CHECK(plant.toGrid() == grid);
+
+  SUBCASE("only the changed subsystem is recomputed") {
+    auto feedGrid = feed.toGrid();
+    auto coolingGrid = cooling.toGrid();
+    cooling.addComponent("fan");
+    CHECK(plant.isDirty());
+    CHECK(!feed.isDirty());
+
+    auto updated = plant.toGrid();
+    CHECK(updated != grid);
+    CHECK(feed.toGrid() == feedGrid);
+    CHECK(cooling.toGrid() != coolingGrid);
+    CHECK(updated->at(3, 3) == "cooling/fan");
+    REQUIRE(updated->blocks.size() == 3);
+    CHECK(updated->blocks[1].grid == feedGrid);
+  }
+
+  SUBCASE("converting a subsystem on its own keeps the parent up to date") {
+    cooling.addComponent("fan");
+    cooling.toGrid();
+    CHECK(plant.isDirty());
+
+    auto updated = plant.toGrid();
+    CHECK(updated != grid);
+    CHECK(updated->at(3, 3) == "cooling/fan");
+  }
+}
+
+namespace {
+
+  // Builds a plant of nested subsystems whose components are wired with a
+  // fixed pseudo-random pattern, so the orderings have crossings to reduce.
+  void fill(zg2g::System &system, std::size_t depth, std::uint32_t &state) {
+    auto next = [&state] { return state = state * 1664525u + 1013904223u; };
+    std::size_t count = 12 + next() % 12;
+    for (std::size_t i = 0; i < count; ++i) system.addComponent("c" + std::to_string(i));
+    for (std::size_t i = 0; i < count * 2; ++i) {
+      std::size_t from = next() % count;
+      std::size_t to = next() % count;
+      if (from != to) system.connect(from, to);
+    }
+    if (depth == 0) return;
+    for (std::size_t i = 0; i < 6; ++i)
+      fill(system.addSubsystem("s" + std::to_string(i)), depth - 1, state);
+  }
+
+}  // namespace
+
+TEST_CASE("System deterministic execution") {
+  using namespace zg2g;
+
+  std::uint32_t state = 7;
+  System plant("plant");
+  fill(plant, 2, state);
+
+  ExecutionPolicy policy;
+  policy.deterministic = true;
+  policy.seed = 42;
+
+  policy.threads = 1;
+  auto reference = System(plant).toGrid(policy);
+  for (std::size_t threads : {4, 16}) {
+    policy.threads = threads;
+    CHECK(*System(plant).toGrid(policy) == *reference);
+  }
+
+  SUBCASE("the default scheduling gives the same grids") {
+    CHECK(*System(plant).toGrid() == *System(plant).toGrid());
+
+    ExecutionPolicy onDemand;
+    onDemand.seed = 42;
+    for (std::size_t threads : {1, 4, 16}) {
+      onDemand.threads = threads;
+      CHECK(*System(plant).toGrid(onDemand) == *reference);
+    }
+  }
+
+  SUBCASE("cached grids from other seeds are not reused") {
+    System copy(plant);
+    policy.seed = 43;
+    CHECK(*copy.toGrid(policy) != *reference);
+    policy.seed = 42;
+    CHECK(*copy.toGrid(policy) == *reference);
+  }
+}
+
+TEST_CASE("System conversion errors") {
+  using namespace zg2g;
+
+  std::uint32_t state = 7;
+  System plant("plant");
+  fill(plant, 2, state);
+
+  // deterministic mode hands task 1, plant/s0/s1, to the second worker
+  ExecutionPolicy policy;
+  policy.threads = 4;
+  policy.deterministic = true;
+  auto caller = std::this_thread::get_id();
+  std::atomic<bool> thrown{false};
+  policy.onConvert = [&](const std::string &) {
+    if (std::this_thread::get_id() != caller) {
+      thrown = true;
+      throw std::runtime_error("conversion failed");
+    }
+  };
+
+  CHECK_THROWS_AS(plant.toGrid(policy), std::runtime_error);
+  CHECK(thrown);
+  CHECK(plant.isDirty());
+  CHECK(plant.subsystem(0).subsystem(1).isDirty());
+
+  policy.onConvert = nullptr;
+  auto grid = plant.toGrid(policy);
+  CHECK(!plant.isDirty());
+
+  std::uint32_t freshState = 7;
+  System fresh("plant");
+  fill(fresh, 2, freshState);
+  CHECK(*grid == *fresh.toGrid(policy));
 }
 
 TEST_CASE("Graph2Grid version") {